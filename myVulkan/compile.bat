@@ -1,3 +1,3 @@
-C:\VulkanSDK\1.2.162.0\Bin32\glslangValidator.exe -V shader.vert
-C:\VulkanSDK\1.2.162.0\Bin32\glslangValidator.exe -V shader.frag
+C:\VulkanSDK\1.2.198.1\Bin32\glslangValidator.exe -V shader.vert
+C:\VulkanSDK\1.2.198.1\Bin32\glslangValidator.exe -V shader.frag
 pause
\ No newline at end of file
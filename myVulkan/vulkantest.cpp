@@ -7,6 +7,8 @@
 #include <cstdlib>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <string>
 #include <set>
 #include <algorithm>
 #include <fstream>
@@ -16,7 +18,36 @@ const int HEIGHT = 600;
 
 const std::vector<const char*> validationLayers = { "VK_LAYER_LUNARG_standard_validation" };
 
-const std::vector<const char*> deviceExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+// dynamic rendering needs depth_stencil_resolve, which needs create_renderpass2
+// multiview and maintenance2 are core in 1.1, so the device must report at least 1.1 (see isDeviceSuitable)
+const std::vector<const char*> deviceExtensions = {
+	VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+	VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+	VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
+	VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+	VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME,
+	VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME,
+};
+
+// state that is set on the command buffer instead of being baked into the pipeline
+// recording code must set every one of these before drawing
+const std::vector<VkDynamicState> dynamicStates = {
+	VK_DYNAMIC_STATE_VIEWPORT,
+	VK_DYNAMIC_STATE_SCISSOR,
+	VK_DYNAMIC_STATE_CULL_MODE_EXT,
+	VK_DYNAMIC_STATE_FRONT_FACE_EXT,
+	VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT,
+	VK_DYNAMIC_STATE_PRIMITIVE_RESTART_ENABLE_EXT,
+};
+
+// only added for pipelines with a depth attachment, and then must be set as well
+const std::vector<VkDynamicState> depthDynamicStates = {
+	VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT,
+	VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT,
+	VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT,
+	VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE_EXT,
+	VK_DYNAMIC_STATE_DEPTH_BIAS,
+};
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -39,6 +70,45 @@ struct QueueFamilyIndices {
 	}
 };
 
+// the static state left in a pipeline once everything in dynamicStates is set at record time
+struct PipelineKey {
+	std::string vertShader;
+	std::string fragShader;
+	VkFormat colorFormat = VK_FORMAT_UNDEFINED;
+	VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+	// only the topology class is static, the exact topology is dynamic
+	VkPrimitiveTopology topologyClass = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+	VkBool32 blendEnable = VK_FALSE;
+
+	bool operator==(const PipelineKey& other) const {
+		return vertShader == other.vertShader
+			&& fragShader == other.fragShader
+			&& colorFormat == other.colorFormat
+			&& depthFormat == other.depthFormat
+			&& topologyClass == other.topologyClass
+			&& polygonMode == other.polygonMode
+			&& blendEnable == other.blendEnable;
+	}
+};
+
+struct PipelineKeyHash {
+	size_t operator()(const PipelineKey& key) const {
+		size_t seed = 0;
+		auto combine = [&seed](size_t value) {
+			seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+		};
+		combine(std::hash<std::string>()(key.vertShader));
+		combine(std::hash<std::string>()(key.fragShader));
+		combine(std::hash<int>()(key.colorFormat));
+		combine(std::hash<int>()(key.depthFormat));
+		combine(std::hash<int>()(key.topologyClass));
+		combine(std::hash<int>()(key.polygonMode));
+		combine(std::hash<uint32_t>()(key.blendEnable));
+		return seed;
+	}
+};
+
 struct SwapChainSupportDetails {
 	VkSurfaceCapabilitiesKHR capabilities;
 	std::vector<VkSurfaceFormatKHR> formats;
@@ -108,6 +178,13 @@ private:
 	}
 
 	void cleanup() {
+		for (auto& pipeline : graphicsPipelines) {
+			vkDestroyPipeline(device, pipeline.second, nullptr);
+		}
+		graphicsPipelines.clear();
+		if (pipelineLayout != VK_NULL_HANDLE) {
+			vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+		}
 		for (auto imageView : swapChainImageViews) {
 			vkDestroyImageView(device, imageView, nullptr);
 		}
@@ -180,7 +257,8 @@ private:
 		appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 		appInfo.pEngineName = "No Engine";
 		appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-		appInfo.apiVersion = VK_API_VERSION_1_0;
+		// 1.1 for vkGetPhysicalDeviceFeatures2 and the extension dependencies of dynamic rendering
+		appInfo.apiVersion = VK_API_VERSION_1_1;
 		// code below is necessary
 		VkInstanceCreateInfo creatInfo = {};
 		creatInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -255,7 +333,8 @@ private:
 		QueueFamilyIndices indices = findQueueFamilies(device);
 
 		bool swapChainAdequate = false;
-		if (checkDeviceExtensionSupport(device)) {
+		bool requirementsAdequate = checkDeviceRequirementSupport(device);
+		if (requirementsAdequate) {
 			SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
 			swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
 		}
@@ -264,10 +343,27 @@ private:
 			|| deviceProperites.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU)
 			&& deviceFeatures.geometryShader
 			&& indices.isComplete()
+			&& requirementsAdequate
 			&& swapChainAdequate;
 	}
 
+	// what createLogicalDevice enables unconditionally, shared by every pick strategy
+	bool checkDeviceRequirementSupport(VkPhysicalDevice device) {
+		VkPhysicalDeviceProperties deviceProperites;
+		vkGetPhysicalDeviceProperties(device, &deviceProperites);
+		// vkGetPhysicalDeviceFeatures2 is only valid on a 1.1 device
+		if (deviceProperites.apiVersion < VK_API_VERSION_1_1) {
+			return false;
+		}
+		return checkDeviceExtensionSupport(device)
+			&& checkDynamicStateFeatureSupport(device);
+	}
+
 	int rateDeviceSuitability(VkPhysicalDevice device) {
+		if (!checkDeviceRequirementSupport(device)) {
+			return 0;
+		}
+
 		int score = 0;
 		VkPhysicalDeviceProperties deviceProperites;
 		VkPhysicalDeviceFeatures deviceFeatures;
@@ -368,9 +464,24 @@ private:
 		queueCreateInfo.queueCount = 1;
 		queueCreateInfo.pQueuePriorities = &queuePriority;
 
+		VkPhysicalDeviceExtendedDynamicState2FeaturesEXT extendedDynamicState2Features = {};
+		extendedDynamicState2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_2_FEATURES_EXT;
+		extendedDynamicState2Features.extendedDynamicState2 = VK_TRUE;
+
+		VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures = {};
+		extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+		extendedDynamicStateFeatures.pNext = &extendedDynamicState2Features;
+		extendedDynamicStateFeatures.extendedDynamicState = VK_TRUE;
+
+		VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures = {};
+		dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+		dynamicRenderingFeatures.pNext = &extendedDynamicStateFeatures;
+		dynamicRenderingFeatures.dynamicRendering = VK_TRUE;
+
 		VkPhysicalDeviceFeatures deviceFeatures = {};
 		VkDeviceCreateInfo createInfo = {};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+		createInfo.pNext = &dynamicRenderingFeatures;
 		createInfo.pQueueCreateInfos = &queueCreateInfo;
 		createInfo.queueCreateInfoCount = 1;
 		createInfo.pEnabledFeatures = &deviceFeatures;
@@ -422,6 +533,28 @@ private:
 		return requiredExtensions.empty();
 	}
 
+	bool checkDynamicStateFeatureSupport(VkPhysicalDevice device) {
+		VkPhysicalDeviceExtendedDynamicState2FeaturesEXT extendedDynamicState2Features = {};
+		extendedDynamicState2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_2_FEATURES_EXT;
+
+		VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures = {};
+		extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+		extendedDynamicStateFeatures.pNext = &extendedDynamicState2Features;
+
+		VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures = {};
+		dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+		dynamicRenderingFeatures.pNext = &extendedDynamicStateFeatures;
+
+		VkPhysicalDeviceFeatures2 deviceFeatures2 = {};
+		deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		deviceFeatures2.pNext = &dynamicRenderingFeatures;
+		vkGetPhysicalDeviceFeatures2(device, &deviceFeatures2);
+
+		return dynamicRenderingFeatures.dynamicRendering
+			&& extendedDynamicStateFeatures.extendedDynamicState
+			&& extendedDynamicState2Features.extendedDynamicState2;
+	}
+
 	SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device) {
 		SwapChainSupportDetails details;
 		vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &details.capabilities);
@@ -565,10 +698,76 @@ private:
 	}
 
 	void createGraphicsPipeline() {
-		auto vertShaderCode = readFile("shaders/vert.spv");
-		auto fragShaderCode = readFile("shaders/frag.spv");
+		PipelineKey key;
+		key.vertShader = "shaders/vert.spv";
+		key.fragShader = "shaders/frag.spv";
+		key.colorFormat = swapChainImageFormat;
+		key.topologyClass = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+		graphicsPipeline = getGraphicsPipeline(key);
+	}
+
+	// pipelines are compatible across topologies of the same class, so only the class goes into the key
+	static VkPrimitiveTopology getTopologyClass(VkPrimitiveTopology topology) {
+		switch (topology)
+		{
+		case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:
+			return VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+		case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
+		case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
+		case VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY:
+		case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY:
+			return VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+		default:
+			return VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+		}
+	}
+
+	// returns the pipeline for key, compiling it only the first time the key is seen
+	VkPipeline getGraphicsPipeline(PipelineKey key) {
+		// patch lists need tessellation stages and state, which the registry does not build
+		if (key.topologyClass == VK_PRIMITIVE_TOPOLOGY_PATCH_LIST) {
+			throw std::runtime_error("patch list topology is not supported by the pipeline registry!");
+		}
+		key.topologyClass = getTopologyClass(key.topologyClass);
+		auto found = graphicsPipelines.find(key);
+		if (found != graphicsPipelines.end()) {
+			return found->second;
+		}
+		VkPipeline pipeline = compileGraphicsPipeline(key);
+		graphicsPipelines.emplace(key, pipeline);
+		return pipeline;
+	}
+
+	void createPipelineLayout() {
+		VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineLayoutInfo.setLayoutCount = 0;
+		pipelineLayoutInfo.pSetLayouts = nullptr;
+		pipelineLayoutInfo.pushConstantRangeCount = 0;
+		pipelineLayoutInfo.pPushConstantRanges = nullptr;
+
+		if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create pipeline layout!");
+		}
+	}
+
+	// always builds a new pipeline, go through getGraphicsPipeline so it ends up in the registry
+	VkPipeline compileGraphicsPipeline(const PipelineKey& key) {
+		if (pipelineLayout == VK_NULL_HANDLE) {
+			createPipelineLayout();
+		}
+
+		auto vertShaderCode = readFile(key.vertShader);
+		auto fragShaderCode = readFile(key.fragShader);
 		VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-		VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+		VkShaderModule fragShaderModule;
+		try {
+			fragShaderModule = createShaderModule(fragShaderCode);
+		}
+		catch (...) {
+			vkDestroyShaderModule(device, vertShaderModule, nullptr);
+			throw;
+		}
 
 		VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
 		vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -593,33 +792,103 @@ private:
 		vertexInputInfo.vertexAttributeDescriptionCount = 0;
 		vertexInputInfo.pVertexAttributeDescriptions = nullptr;
 
+		// topology and primitive restart are dynamic, this only fixes the topology class
 		VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
 		inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-		inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+		inputAssembly.topology = key.topologyClass;
 		inputAssembly.primitiveRestartEnable = VK_FALSE;
 
-		VkViewport viewport = {};
-		viewport.x = 0.0f;
-		viewport.y = 0.0f;
-		viewport.width = (float)swapChainExtent.width;
-		viewport.height = (float)swapChainExtent.height;
-		viewport.minDepth = 0.0f;
-		viewport.maxDepth = 1.0f;
-
-		VkRect2D scissor = {};
-		scissor.offset = { 0,0 };
-		scissor.extent = swapChainExtent;
-
+		// viewport and scissor are dynamic, so only the counts are needed here
 		VkPipelineViewportStateCreateInfo viewportState = {};
 		viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-		viewportState.pViewports = &viewport;
 		viewportState.viewportCount = 1;
+		viewportState.pViewports = nullptr;
 		viewportState.scissorCount = 1;
-		viewportState.pScissors = &scissor;
+		viewportState.pScissors = nullptr;
+
+		// cull mode and front face are dynamic, depth bias enable and factors too with a depth attachment
+		VkPipelineRasterizationStateCreateInfo rasterizer = {};
+		rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+		rasterizer.depthClampEnable = VK_FALSE;
+		rasterizer.rasterizerDiscardEnable = VK_FALSE;
+		rasterizer.polygonMode = key.polygonMode;
+		rasterizer.lineWidth = 1.0f;
+
+		VkPipelineMultisampleStateCreateInfo multisampling = {};
+		multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+		multisampling.sampleShadingEnable = VK_FALSE;
+		multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+		// only used with a depth attachment, whose test, write and compare op are dynamic
+		VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+		depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+		depthStencil.depthBoundsTestEnable = VK_FALSE;
+		depthStencil.stencilTestEnable = VK_FALSE;
+
+		VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+		colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+			VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+		colorBlendAttachment.blendEnable = key.blendEnable;
+		colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+		colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+		colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+		colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+		colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+		VkPipelineColorBlendStateCreateInfo colorBlending = {};
+		colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+		colorBlending.logicOpEnable = VK_FALSE;
+		colorBlending.attachmentCount = 1;
+		colorBlending.pAttachments = &colorBlendAttachment;
+
+		std::vector<VkDynamicState> pipelineDynamicStates(dynamicStates);
+		if (key.depthFormat != VK_FORMAT_UNDEFINED) {
+			pipelineDynamicStates.insert(pipelineDynamicStates.end(), depthDynamicStates.begin(), depthDynamicStates.end());
+		}
+
+		VkPipelineDynamicStateCreateInfo dynamicState = {};
+		dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+		dynamicState.dynamicStateCount = static_cast<uint32_t>(pipelineDynamicStates.size());
+		dynamicState.pDynamicStates = pipelineDynamicStates.data();
+
+		// dynamic rendering: attachment formats replace the render pass
+		VkPipelineRenderingCreateInfoKHR renderingInfo = {};
+		renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+		renderingInfo.colorAttachmentCount = 1;
+		renderingInfo.pColorAttachmentFormats = &key.colorFormat;
+		renderingInfo.depthAttachmentFormat = key.depthFormat;
+		renderingInfo.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+
+		VkGraphicsPipelineCreateInfo pipelineInfo = {};
+		pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+		pipelineInfo.pNext = &renderingInfo;
+		pipelineInfo.stageCount = 2;
+		pipelineInfo.pStages = shaderStages;
+		pipelineInfo.pVertexInputState = &vertexInputInfo;
+		pipelineInfo.pInputAssemblyState = &inputAssembly;
+		pipelineInfo.pViewportState = &viewportState;
+		pipelineInfo.pRasterizationState = &rasterizer;
+		pipelineInfo.pMultisampleState = &multisampling;
+		pipelineInfo.pDepthStencilState = key.depthFormat != VK_FORMAT_UNDEFINED ? &depthStencil : nullptr;
+		pipelineInfo.pColorBlendState = &colorBlending;
+		pipelineInfo.pDynamicState = &dynamicState;
+		pipelineInfo.layout = pipelineLayout;
+		pipelineInfo.renderPass = VK_NULL_HANDLE;
+		pipelineInfo.subpass = 0;
+		pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+		pipelineInfo.basePipelineIndex = -1;
+
+		VkPipeline pipeline;
+		VkResult result = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline);
 
 		vkDestroyShaderModule(device, fragShaderModule, nullptr);
 		vkDestroyShaderModule(device, vertShaderModule, nullptr);
 
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("failed to create graphics pipeline!");
+		}
+		return pipeline;
 	}
 
 	VkShaderModule createShaderModule(const std::vector<char>& code) {
@@ -647,6 +916,10 @@ private:
 	VkFormat swapChainImageFormat;
 	VkExtent2D swapChainExtent;
 	std::vector<VkImageView> swapChainImageViews;
+	VkPipelineLayout pipelineLayout{ VK_NULL_HANDLE };
+	// borrowed from graphicsPipelines, do not destroy it separately
+	VkPipeline graphicsPipeline{ VK_NULL_HANDLE };
+	std::unordered_map<PipelineKey, VkPipeline, PipelineKeyHash> graphicsPipelines;
 };
 
 int main() {